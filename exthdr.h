@@ -0,0 +1,47 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (C) 2015, 2016 Michael Andersen <m.andersen@cs.berkeley.edu>
+ * (C) 2015, 2016 Sam Kumar <samkumar@berkeley.edu>
+ * (C) 2015, 2016 Regents of the University of California
+ */
+
+/* The extended header, shared by sender.c and receiver/receiver.c. When it is
+ * sent, EXTHEADER_FLAG is set in the length of the filepath and a
+ * file_metadata_t follows the lengths, before the filepath.
+ */
+
+#ifndef EXTHDR_H
+#define EXTHDR_H
+
+#include <stdint.h>
+
+#define EXTHEADER_FLAG 0x80000000u // set in the length of the filepath when the extended header is sent
+#define EXTHEADERLEN 32 // the length of the metadata in the extended header
+
+// The metadata sent in the extended header, little-endian like the lengths.
+// Anomalies are counted in records (one record covers one second).
+typedef struct
+{
+    int64_t first_time; // the time of the earliest record, in seconds since the epoch (UTC)
+    int64_t last_time; // the time of the latest record, in seconds since the epoch (UTC)
+    uint32_t num_records; // records with valid times (all the others are left out, so the file counts as partial)
+    uint32_t lock_changes; // records whose lockstate changes from the previous sample
+    uint32_t nofix_records; // records taken without a GPS fix
+    uint32_t discontinuities; // the number of gaps between the record times once sorted (0 if every second is present)
+} file_metadata_t;
+
+_Static_assert(sizeof(file_metadata_t) == EXTHEADERLEN, "file_metadata_t must match the extended header on the wire");
+
+#endif
@@ -0,0 +1,940 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (C) 2015, 2016 Michael Andersen <m.andersen@cs.berkeley.edu>
+ * (C) 2015, 2016 Sam Kumar <samkumar@berkeley.edu>
+ * (C) 2015, 2016 Regents of the University of California
+ */
+
+/* A native stand-in for receiver.go that needs no database. It accepts the
+ * messages produced by send_file() in sender.c on any number of connections,
+ * appends each one to an append-only store file, and acknowledges a batch of
+ * messages only once the fdatasync() that makes all of them durable has
+ * completed (group commit).
+ * Messages sent with the extended header carry the time range of the records
+ * in the file; these are kept in a per-serial index of the intervals received,
+ * so gaps are found without looking at the data.
+ */
+
+#define MAXFILEPATHLEN 512 // the maximum length of a filepath sent by a uPMU
+#define MAXSERNUMLEN 32 // the maximum length of a serial number sent by a uPMU
+#define MAXDATALEN 75744000 // the maximum length of the contents of a file
+#define MAXEVENTS 256 // the maximum number of events handled per call to epoll_wait
+#define MAXREADSPERWAKEUP 16 // the maximum number of reads from one connection per event, so no connection starves the others
+#define MAXBATCH 1024 // the maximum number of messages in a group commit
+#define LISTENBACKLOG 1024 // the length of the queue of connections waiting to be accepted
+#define STATSINTERVAL 5 // the number of seconds between printing statistics
+#define STOREFILE "store.dat" // the name of the append-only store within the store directory
+#define STOREMAGIC 0x554D5052u // marks the start of each record in the store ("RPMU" in little-endian)
+#define INDEXFILE "intervals.txt" // the name of the file within the store directory listing the intervals received
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "../exthdr.h"
+
+int ADDRESSP = 1883;
+
+// the parts of a message, in the order in which they are received
+enum message_part
+{
+    PART_INFO,
+    PART_METADATA,
+    PART_FILEPATH,
+    PART_SERIAL,
+    PART_DATA
+};
+
+typedef struct
+{
+    int fd;
+    char addr[INET_ADDRSTRLEN + 6];
+    uint32_t part; // the part of the message currently being received
+    uint32_t have; // the number of bytes of the current part received so far
+    uint8_t info[16] __attribute__((aligned(4))); // sendid, length of filepath, length of serial number, length of data
+    uint32_t lenfp;
+    uint32_t lensn;
+    uint32_t lendt;
+    int extended; // 1 if the current message has the extended header
+    file_metadata_t metadata;
+    char filepath[MAXFILEPATHLEN + 1]; // NUL-terminated once received
+    char sernum[MAXSERNUMLEN];
+    uint8_t* data; // allocated once the length of the data is known, and freed once it is in the store
+} conn_t;
+
+// The header of each record in the store. It is followed by the metadata (if
+// EXTHEADER_FLAG is set in lenfp, as on the wire), the filepath and serial number
+// (each padded to a multiple of 4 bytes, as on the wire) and the data.
+typedef struct
+{
+    uint32_t magic;
+    uint32_t lenfp;
+    uint32_t lensn;
+    uint32_t lendt;
+    uint64_t time_received; // microseconds since the epoch
+} store_record_t;
+
+// a message that is in the store but not yet acknowledged
+typedef struct
+{
+    conn_t* conn; // NULL if the connection was closed before the commit
+    uint32_t sendid;
+    int extended;
+    file_metadata_t metadata;
+    char sernum[MAXSERNUMLEN + 1];
+} pending_ack_t;
+
+// a span of time for which a uPMU's data has been received, in seconds since the epoch (inclusive)
+typedef struct
+{
+    int64_t first;
+    int64_t last;
+    uint32_t partial_records; // 0 if every second was received, otherwise the number of records in the file
+} interval_t;
+
+// The intervals received from one uPMU, sorted by their first times. Complete
+// intervals are merged so that none touch, even with partial intervals sorted
+// between them; a partial interval comes from one file with seconds missing
+// inside it and is never merged.
+typedef struct
+{
+    char sernum[MAXSERNUMLEN + 1];
+    interval_t* intervals;
+    uint32_t num_intervals;
+    uint32_t size_intervals;
+} serial_index_t;
+
+// the store, its directory, the offset up to which it contains complete records,
+// and the offset up to which those records were made durable by a successful commit
+int store_fd = -1;
+const char* store_dir;
+uint64_t store_end = 0;
+uint64_t store_committed = 0;
+
+// the interval index, and whether it has changed since it was last written to INDEXFILE
+serial_index_t* serials = NULL;
+uint32_t num_serials = 0;
+uint32_t size_serials = 0;
+int index_changed = 0;
+
+// the messages waiting for the next group commit
+pending_ack_t pending[MAXBATCH];
+int num_pending = 0;
+
+// statistics printed every STATSINTERVAL seconds
+uint64_t num_files = 0;
+uint64_t num_bytes = 0;
+uint64_t num_commits = 0;
+int num_conns = 0;
+
+/* Finds the smallest int larger than the input that's a multiple of 4. */
+uint32_t roundUp4(uint32_t input)
+{
+    return (input + 3) & 0xFFFFFFFCu;
+}
+
+/* Formats T (seconds since the epoch) as a UTC time in BUF, which must hold at least 21 bytes. */
+void format_time(int64_t t, char* buf)
+{
+    time_t tt = (time_t) t;
+    struct tm tm;
+    gmtime_r(&tt, &tm);
+    strftime(buf, 21, "%Y-%m-%dT%H:%M:%SZ", &tm);
+}
+
+/* Returns the index entry for the uPMU with serial number SERNUM, creating it if necessary. */
+serial_index_t* index_lookup(const char* sernum)
+{
+    uint32_t i;
+    for (i = 0; i < num_serials; i++)
+    {
+        if (strcmp(serials[i].sernum, sernum) == 0)
+        {
+            return &serials[i];
+        }
+    }
+    if (num_serials == size_serials)
+    {
+        size_serials = (size_serials == 0) ? 16 : size_serials * 2;
+        serials = realloc(serials, size_serials * sizeof(serial_index_t));
+        if (serials == NULL)
+        {
+            printf("Could not allocate memory to store the interval index.\n");
+            exit(1);
+        }
+    }
+    serial_index_t* entry = &serials[num_serials++];
+    memset(entry, 0, sizeof(serial_index_t));
+    strcpy(entry->sernum, sernum);
+    return entry;
+}
+
+/* Adds the time range described by METADATA to the intervals received from the
+ * uPMU with serial number SERNUM. If REPORT is 1, gaps that the new range leaves
+ * after the previous data, gaps that it fills, and anomalies within the file
+ * are printed.
+ */
+void index_add(const char* sernum, const file_metadata_t* metadata, int report)
+{
+    char first[21], last[21];
+    if (metadata->num_records == 0)
+    {
+        return;
+    }
+    if (metadata->first_time > metadata->last_time)
+    {
+        format_time(metadata->first_time, first);
+        format_time(metadata->last_time, last);
+        printf("WARNING: ignoring inverted time range %s to %s from %s (not added to interval index)\n", first, last, sernum);
+        return;
+    }
+    uint64_t span = metadata->last_time - metadata->first_time + 1;
+    uint32_t partial_records = (metadata->discontinuities != 0 || metadata->num_records < span) ? metadata->num_records : 0;
+    if (report && (metadata->discontinuities != 0 || metadata->lock_changes != 0 || metadata->nofix_records != 0))
+    {
+        format_time(metadata->first_time, first);
+        printf("WARNING: file from %s starting at %s has %u gaps, %u lockstate changes and %u records without GPS fix\n",
+               sernum, first, metadata->discontinuities, metadata->lock_changes, metadata->nofix_records);
+    }
+    if (report && partial_records != 0)
+    {
+        format_time(metadata->first_time, first);
+        format_time(metadata->last_time, last);
+        printf("Partial data from %s: %u records for the %llu seconds from %s to %s\n", sernum, partial_records,
+               (unsigned long long) span, first, last);
+    }
+    serial_index_t* entry = index_lookup(sernum);
+    if (entry->num_intervals == entry->size_intervals)
+    {
+        entry->size_intervals = (entry->size_intervals == 0) ? 8 : entry->size_intervals * 2;
+        entry->intervals = realloc(entry->intervals, entry->size_intervals * sizeof(interval_t));
+        if (entry->intervals == NULL)
+        {
+            printf("Could not allocate memory to store the interval index.\n");
+            exit(1);
+        }
+    }
+    // Files almost always arrive in order, so search for the position from the end
+    interval_t* intervals = entry->intervals;
+    uint32_t pos = entry->num_intervals;
+    while (pos > 0 && intervals[pos - 1].first > metadata->first_time)
+    {
+        pos--;
+    }
+    if (report && pos == entry->num_intervals && pos > 0 && metadata->first_time > intervals[pos - 1].last + 1)
+    {
+        format_time(intervals[pos - 1].last + 1, first);
+        format_time(metadata->first_time - 1, last);
+        printf("Gap in data from %s: nothing from %s to %s (%lld seconds)\n", sernum, first, last,
+               (long long) (metadata->first_time - intervals[pos - 1].last - 1));
+    }
+    else if (report && pos < entry->num_intervals)
+    {
+        format_time(metadata->first_time, first);
+        format_time(metadata->last_time, last);
+        printf("Backfilled data from %s: %s to %s\n", sernum, first, last);
+    }
+    memmove(&intervals[pos + 1], &intervals[pos], (entry->num_intervals - pos) * sizeof(interval_t));
+    intervals[pos].first = metadata->first_time;
+    intervals[pos].last = metadata->last_time;
+    intervals[pos].partial_records = partial_records;
+    entry->num_intervals++;
+    index_changed = 1;
+    if (partial_records != 0)
+    {
+        return;
+    }
+    // Merge with the closest complete interval before it, then absorb any complete
+    // intervals after it that now touch it, passing over partial intervals either way
+    uint32_t prev = pos;
+    while (prev > 0 && intervals[prev - 1].partial_records != 0)
+    {
+        prev--;
+    }
+    if (prev > 0 && intervals[prev - 1].last + 1 >= intervals[pos].first)
+    {
+        prev--;
+        if (intervals[pos].last > intervals[prev].last)
+        {
+            intervals[prev].last = intervals[pos].last;
+        }
+        memmove(&intervals[pos], &intervals[pos + 1], (entry->num_intervals - pos - 1) * sizeof(interval_t));
+        entry->num_intervals--;
+        pos = prev;
+    }
+    uint32_t next = pos + 1;
+    while (next < entry->num_intervals && intervals[pos].last + 1 >= intervals[next].first)
+    {
+        if (intervals[next].partial_records != 0)
+        {
+            next++;
+            continue;
+        }
+        if (intervals[next].last > intervals[pos].last)
+        {
+            intervals[pos].last = intervals[next].last;
+        }
+        memmove(&intervals[next], &intervals[next + 1], (entry->num_intervals - next - 1) * sizeof(interval_t));
+        entry->num_intervals--;
+    }
+}
+
+/* Writes the interval index to INDEXFILE in the store directory, one interval
+ * per line ("<serial number> <first time> <last time>", followed by
+ * "partial <number of records>" for a partial interval), so that time ranges and
+ * gaps can be looked up without reading the store. The file is written under a
+ * temporary name and renamed so that a reader never sees a partial index.
+ */
+void write_index()
+{
+    char first[21], last[21];
+    char indexpath[strlen(store_dir) + strlen(INDEXFILE) + 6];
+    char tmppath[sizeof(indexpath)];
+    sprintf(indexpath, "%s/%s", store_dir, INDEXFILE);
+    sprintf(tmppath, "%s.tmp", indexpath);
+    FILE* output = fopen(tmppath, "w");
+    if (output == NULL)
+    {
+        printf("Could not open %s to write the interval index\n", tmppath);
+        return;
+    }
+    uint32_t i, j;
+    for (i = 0; i < num_serials; i++)
+    {
+        for (j = 0; j < serials[i].num_intervals; j++)
+        {
+            format_time(serials[i].intervals[j].first, first);
+            format_time(serials[i].intervals[j].last, last);
+            if (serials[i].intervals[j].partial_records != 0)
+            {
+                fprintf(output, "%s %s %s partial %u\n", serials[i].sernum, first, last, serials[i].intervals[j].partial_records);
+            }
+            else
+            {
+                fprintf(output, "%s %s %s\n", serials[i].sernum, first, last);
+            }
+        }
+    }
+    if (fclose(output) != 0 || rename(tmppath, indexpath) != 0)
+    {
+        printf("Could not write the interval index to %s\n", indexpath);
+        return;
+    }
+    index_changed = 0;
+}
+
+/* Exit, making sure that everything in the store is durable. */
+void safe_exit(int arg)
+{
+    printf("Exiting...\n");
+    if (index_changed)
+    {
+        write_index();
+    }
+    if (store_fd != -1)
+    {
+        fdatasync(store_fd);
+        close(store_fd);
+    }
+    fflush(stdout);
+    exit(arg);
+}
+
+void interrupt_handler(int sig)
+{
+    safe_exit(0);
+}
+
+/* Writes all LEN bytes of BUF to the socket FD, which is nonblocking. Since each
+ * response is only 4 bytes, the socket buffer is full only if the uPMU has stopped
+ * reading; in that case the connection is treated as failed.
+ * Returns 0 on success and -1 on failure.
+ */
+int write_response(int fd, const void* buf, size_t len)
+{
+    ssize_t datawritten;
+    do
+    {
+        datawritten = write(fd, buf, len);
+    } while (datawritten < 0 && errno == EINTR);
+    return (datawritten == (ssize_t) len) ? 0 : -1;
+}
+
+/* Opens the store in STOREDIR, creating it if necessary. If the last record in
+ * the store is incomplete (because we crashed while appending it), it is
+ * truncated away; it was never acknowledged, so the uPMU will send it again.
+ */
+void open_store(const char* storedir)
+{
+    store_dir = storedir;
+    char storepath[strlen(storedir) + strlen(STOREFILE) + 2];
+    strcpy(storepath, storedir);
+    strcat(storepath, "/");
+    strcat(storepath, STOREFILE);
+    store_fd = open(storepath, O_RDWR | O_CREAT, 0644);
+    if (store_fd < 0)
+    {
+        printf("Could not open store %s\n", storepath);
+        perror("Details");
+        safe_exit(1);
+    }
+    struct stat storeStats;
+    if (fstat(store_fd, &storeStats) != 0)
+    {
+        perror("could not stat store");
+        safe_exit(1);
+    }
+    uint64_t size = storeStats.st_size;
+    uint64_t numrecords = 0;
+    store_record_t record;
+    file_metadata_t metadata;
+    char sernum[MAXSERNUMLEN + 1];
+    uint32_t lenmd, lenfp;
+    while (store_end + sizeof(record) <= size)
+    {
+        if (pread(store_fd, &record, sizeof(record), store_end) != sizeof(record) || record.magic != STOREMAGIC)
+        {
+            break;
+        }
+        lenmd = (record.lenfp & EXTHEADER_FLAG) ? EXTHEADERLEN : 0;
+        lenfp = record.lenfp & ~EXTHEADER_FLAG;
+        if (lenfp > MAXFILEPATHLEN || record.lensn > MAXSERNUMLEN || record.lendt > MAXDATALEN)
+        {
+            break;
+        }
+        uint64_t reclen = sizeof(record) + lenmd + roundUp4(lenfp) + roundUp4(record.lensn) + record.lendt;
+        if (store_end + reclen > size)
+        {
+            break;
+        }
+        // Rebuild the interval index from the metadata, without reading the data
+        if (lenmd != 0)
+        {
+            memset(sernum, 0, sizeof(sernum));
+            if (pread(store_fd, &metadata, EXTHEADERLEN, store_end + sizeof(record)) != EXTHEADERLEN
+                || pread(store_fd, sernum, record.lensn, store_end + sizeof(record) + lenmd + roundUp4(lenfp)) != record.lensn)
+            {
+                break;
+            }
+            index_add(sernum, &metadata, 0);
+        }
+        store_end += reclen;
+        numrecords++;
+    }
+    if (store_end != size)
+    {
+        printf("Truncating %llu bytes of incomplete record(s) at the end of the store\n", (unsigned long long) (size - store_end));
+        if (ftruncate(store_fd, store_end) != 0 || fdatasync(store_fd) != 0)
+        {
+            perror("could not truncate store");
+            safe_exit(1);
+        }
+    }
+    if (lseek(store_fd, store_end, SEEK_SET) < 0)
+    {
+        perror("could not seek to end of store");
+        safe_exit(1);
+    }
+    store_committed = store_end;
+    // Make sure the directory entry for a newly created store is durable
+    int dir_fd = open(storedir, O_RDONLY);
+    if (dir_fd >= 0)
+    {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    printf("Opened store %s (%llu records, %llu bytes, %u uPMUs in interval index)\n", storepath, (unsigned long long) numrecords,
+           (unsigned long long) store_end, num_serials);
+    write_index();
+}
+
+/* Appends the message that CONN has finished receiving to the store.
+ * Returns 0 on success and -1 on failure, in which case the store is left as
+ * it was before the call.
+ */
+int store_append(conn_t* conn)
+{
+    uint8_t padding[4] = { 0, 0, 0, 0 };
+    store_record_t record;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record.magic = STOREMAGIC;
+    record.lenfp = conn->extended ? (conn->lenfp | EXTHEADER_FLAG) : conn->lenfp;
+    record.lensn = conn->lensn;
+    record.lendt = conn->lendt;
+    record.time_received = ((uint64_t) now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+
+    struct iovec iov[7];
+    iov[0].iov_base = &record;
+    iov[0].iov_len = sizeof(record);
+    iov[1].iov_base = &conn->metadata;
+    iov[1].iov_len = conn->extended ? EXTHEADERLEN : 0;
+    iov[2].iov_base = conn->filepath;
+    iov[2].iov_len = conn->lenfp;
+    iov[3].iov_base = padding;
+    iov[3].iov_len = roundUp4(conn->lenfp) - conn->lenfp;
+    iov[4].iov_base = conn->sernum;
+    iov[4].iov_len = conn->lensn;
+    iov[5].iov_base = padding;
+    iov[5].iov_len = roundUp4(conn->lensn) - conn->lensn;
+    iov[6].iov_base = conn->data;
+    iov[6].iov_len = conn->lendt;
+
+    uint64_t reclen = sizeof(record) + iov[1].iov_len + roundUp4(conn->lenfp) + roundUp4(conn->lensn) + conn->lendt;
+    uint64_t written = 0;
+    ssize_t datawritten;
+    int i = 0;
+    while (written < reclen)
+    {
+        datawritten = writev(store_fd, iov + i, 7 - i);
+        if (datawritten < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf("Could not append %s to the store\n", conn->filepath);
+            perror("Details");
+            if (ftruncate(store_fd, store_end) != 0 || lseek(store_fd, store_end, SEEK_SET) < 0)
+            {
+                perror("could not roll back store");
+                safe_exit(1);
+            }
+            return -1;
+        }
+        written += datawritten;
+        // Skip the iovecs that were written completely and adjust the one written partially
+        while (i < 7 && (size_t) datawritten >= iov[i].iov_len)
+        {
+            datawritten -= iov[i].iov_len;
+            i++;
+        }
+        if (i < 7)
+        {
+            iov[i].iov_base = ((uint8_t*) iov[i].iov_base) + datawritten;
+            iov[i].iov_len -= datawritten;
+        }
+    }
+    store_end += reclen;
+    num_bytes += conn->lendt;
+    return 0;
+}
+
+/* Makes every message appended since the last commit durable, and only then
+ * acknowledges each of them with its sendid and adds its time range to the
+ * interval index. If the commit fails the uPMUs are told so (with a response
+ * of 0) and will send the files again, so the records are truncated away to
+ * keep a later commit from making duplicates of them durable.
+ */
+void commit()
+{
+    if (num_pending == 0)
+    {
+        return;
+    }
+    uint32_t failure = 0;
+    int synced = (fdatasync(store_fd) == 0);
+    if (synced)
+    {
+        store_committed = store_end;
+    }
+    else
+    {
+        perror("could not commit store");
+        if (ftruncate(store_fd, store_committed) != 0 || lseek(store_fd, store_committed, SEEK_SET) < 0)
+        {
+            perror("could not roll back store");
+            safe_exit(1);
+        }
+        store_end = store_committed;
+    }
+    int i;
+    for (i = 0; i < num_pending; i++)
+    {
+        if (synced && pending[i].extended)
+        {
+            index_add(pending[i].sernum, &pending[i].metadata, 1);
+        }
+        if (pending[i].conn == NULL)
+        {
+            continue;
+        }
+        if (write_response(pending[i].conn->fd, synced ? &pending[i].sendid : &failure, 4) != 0)
+        {
+            // The uPMU will time out and send the file again
+            printf("Could not acknowledge message %u from %s\n", pending[i].sendid, pending[i].conn->addr);
+        }
+    }
+    num_files += num_pending;
+    num_commits++;
+    num_pending = 0;
+}
+
+/* Closes CONN, forgetting any acknowledgements still pending for it. */
+void close_conn(int epoll_fd, conn_t* conn)
+{
+    int i;
+    for (i = 0; i < num_pending; i++)
+    {
+        if (pending[i].conn == conn)
+        {
+            pending[i].conn = NULL;
+        }
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    free(conn->data);
+    free(conn);
+    num_conns--;
+}
+
+/* Checks the lengths in the info part of CONN's current message and allocates
+ * space for the data. Returns 0 if the message can be received and -1 if not.
+ */
+int process_info(conn_t* conn)
+{
+    conn->lenfp = ((uint32_t*) conn->info)[1];
+    conn->extended = (conn->lenfp & EXTHEADER_FLAG) != 0;
+    conn->lenfp &= ~EXTHEADER_FLAG;
+    conn->lensn = ((uint32_t*) conn->info)[2];
+    conn->lendt = ((uint32_t*) conn->info)[3];
+    if (conn->lenfp > MAXFILEPATHLEN)
+    {
+        printf("Filepath length fails sanity check: %u (from %s)\n", conn->lenfp, conn->addr);
+        return -1;
+    }
+    if (conn->lensn > MAXSERNUMLEN)
+    {
+        printf("Serial number length fails sanity check: %u (from %s)\n", conn->lensn, conn->addr);
+        return -1;
+    }
+    if (conn->lendt > MAXDATALEN)
+    {
+        printf("Data length fails sanity check: %u (from %s)\n", conn->lendt, conn->addr);
+        return -1;
+    }
+    conn->data = malloc(conn->lendt == 0 ? 1 : conn->lendt);
+    if (conn->data == NULL)
+    {
+        printf("Could not allocate memory to store data from %s\n", conn->addr);
+        return -1;
+    }
+    return 0;
+}
+
+/* Reads whatever is available on CONN directly into the part of the message
+ * being received, handling each message that is completed. Returns 0 if the
+ * connection is still usable and -1 if it should be closed.
+ */
+int handle_readable(conn_t* conn)
+{
+    uint8_t* dest;
+    uint32_t partlen;
+    ssize_t dataread;
+    int numreads = 0;
+    while (numreads < MAXREADSPERWAKEUP)
+    {
+        switch (conn->part)
+        {
+            case PART_INFO:
+                dest = conn->info;
+                partlen = 16;
+                break;
+            case PART_METADATA:
+                dest = (uint8_t*) &conn->metadata;
+                partlen = conn->extended ? EXTHEADERLEN : 0;
+                break;
+            case PART_FILEPATH:
+                dest = (uint8_t*) conn->filepath;
+                partlen = roundUp4(conn->lenfp);
+                break;
+            case PART_SERIAL:
+                dest = (uint8_t*) conn->sernum;
+                partlen = roundUp4(conn->lensn);
+                break;
+            default:
+                dest = conn->data;
+                partlen = conn->lendt;
+                break;
+        }
+        if (conn->have < partlen)
+        {
+            dataread = read(conn->fd, dest + conn->have, partlen - conn->have);
+            if (dataread < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    return 0;
+                }
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                printf("Connection lost: %s (read failed: %s)\n", conn->addr, strerror(errno));
+                return -1;
+            }
+            if (dataread == 0)
+            {
+                printf("Connection closed: %s\n", conn->addr);
+                return -1;
+            }
+            conn->have += dataread;
+            numreads++;
+            if (conn->have < partlen)
+            {
+                continue;
+            }
+        }
+        // The current part is complete
+        conn->have = 0;
+        if (conn->part == PART_INFO)
+        {
+            if (process_info(conn) != 0)
+            {
+                return -1;
+            }
+            conn->part = PART_METADATA;
+        }
+        else if (conn->part != PART_DATA)
+        {
+            if (conn->part == PART_FILEPATH)
+            {
+                // Only the filepath itself goes in the store, so the padding can be overwritten
+                conn->filepath[conn->lenfp] = '\0';
+            }
+            conn->part++;
+        }
+        else
+        {
+            uint32_t sendid = ((uint32_t*) conn->info)[0];
+            uint32_t failure = 0;
+            int result = store_append(conn);
+            free(conn->data);
+            conn->data = NULL;
+            conn->part = PART_INFO;
+            if (result != 0)
+            {
+                if (write_response(conn->fd, &failure, 4) != 0)
+                {
+                    return -1;
+                }
+                continue;
+            }
+            if (num_pending == MAXBATCH)
+            {
+                commit();
+            }
+            pending[num_pending].conn = conn;
+            pending[num_pending].sendid = sendid;
+            pending[num_pending].extended = conn->extended;
+            pending[num_pending].metadata = conn->metadata;
+            memcpy(pending[num_pending].sernum, conn->sernum, conn->lensn);
+            pending[num_pending].sernum[conn->lensn] = '\0';
+            num_pending++;
+        }
+    }
+    return 0;
+}
+
+/* Accepts every connection waiting on LISTEN_FD. */
+void handle_accept(int epoll_fd, int listen_fd)
+{
+    struct sockaddr_in client;
+    socklen_t clientlen;
+    int fd;
+    while (1)
+    {
+        clientlen = sizeof(client);
+        fd = accept(listen_fd, (struct sockaddr*) &client, &clientlen);
+        if (fd < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                perror("could not accept incoming TCP connection");
+            }
+            return;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        conn_t* conn = calloc(1, sizeof(conn_t));
+        if (conn == NULL)
+        {
+            printf("Could not allocate memory for a new connection\n");
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->part = PART_INFO;
+        inet_ntop(AF_INET, &client.sin_addr, conn->addr, INET_ADDRSTRLEN);
+        sprintf(conn->addr + strlen(conn->addr), ":%u", ntohs(client.sin_port));
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+        {
+            perror("could not watch new connection");
+            close(fd);
+            free(conn);
+            continue;
+        }
+        printf("Connected: %s\n", conn->addr);
+        num_conns++;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    setbuf(stderr, NULL);
+    if (argc != 2 && argc != 3)
+    {
+        printf("Usage: %s <storedirectory> [<port number>]\n", argv[0]);
+        safe_exit(1);
+    }
+
+    if (argc == 3)
+    {
+        errno = 0;
+        unsigned long port = strtoul(argv[2], NULL, 0);
+        if (port > 65535 || port == 0 || errno != 0)
+        {
+            printf("Invalid port %s\n", argv[2]);
+            safe_exit(1);
+        }
+        ADDRESSP = (int) port;
+    }
+
+    // Allow as many connections as the hard limit on file descriptors permits
+    struct rlimit fdlimit;
+    if (getrlimit(RLIMIT_NOFILE, &fdlimit) == 0)
+    {
+        fdlimit.rlim_cur = fdlimit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fdlimit);
+    }
+
+    // Set up signals to handle Ctrl-C (sync the store before terminating)
+    struct sigaction interrupt_action;
+    interrupt_action.sa_handler = interrupt_handler;
+    interrupt_action.sa_flags = 0;
+    sigemptyset(&interrupt_action.sa_mask);
+    if (-1 == sigaction(SIGINT, &interrupt_action, NULL) || -1 == sigaction(SIGTERM, &interrupt_action, NULL))
+    {
+        printf("Could not set up signal to handle keyboard interrupt\n");
+        exit(1);
+    }
+
+    struct sigaction socket_action;
+    socket_action.sa_handler = SIG_IGN;
+    socket_action.sa_flags = 0;
+    sigemptyset(&socket_action.sa_mask);
+    if (-1 == sigaction(SIGPIPE, &socket_action, NULL))
+    {
+        printf("Could not set up signal to handle writing to broken socket\n");
+        exit(1);
+    }
+
+    open_store(argv[1]);
+
+    int listen_fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listen_fd < 0)
+    {
+        perror("could not create socket");
+        safe_exit(1);
+    }
+    int reuse = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(ADDRESSP);
+    server.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(listen_fd, (struct sockaddr*) &server, sizeof(server)) != 0 || listen(listen_fd, LISTENBACKLOG) != 0)
+    {
+        perror("could not create bound TCP server socket");
+        safe_exit(1);
+    }
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+    int epoll_fd = epoll_create(MAXEVENTS);
+    if (epoll_fd < 0)
+    {
+        perror("epoll_create");
+        safe_exit(1);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // the listening socket is the only one without a connection
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) != 0)
+    {
+        perror("epoll_ctl");
+        safe_exit(1);
+    }
+
+    printf("Waiting for incoming connections on port %d...\n", ADDRESSP);
+
+    struct epoll_event events[MAXEVENTS];
+    int numevents;
+    int i;
+    time_t laststats = time(NULL);
+    time_t now;
+    while (1)
+    {
+        numevents = epoll_wait(epoll_fd, events, MAXEVENTS, 1000);
+        if (numevents < 0 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            safe_exit(1);
+        }
+        for (i = 0; i < numevents; i++)
+        {
+            conn_t* conn = events[i].data.ptr;
+            if (conn == NULL)
+            {
+                handle_accept(epoll_fd, listen_fd);
+            }
+            else if (handle_readable(conn) != 0)
+            {
+                close_conn(epoll_fd, conn);
+            }
+        }
+        // Every message completed during this wakeup shares one fdatasync
+        commit();
+
+        now = time(NULL);
+        if (now - laststats >= STATSINTERVAL)
+        {
+            printf("Committed %llu files (%llu bytes of data) in %llu group commits; %d connections open\n",
+                   (unsigned long long) num_files, (unsigned long long) num_bytes, (unsigned long long) num_commits, num_conns);
+            laststats = now;
+            if (index_changed)
+            {
+                write_index();
+            }
+        }
+    }
+}
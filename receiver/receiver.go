@@ -27,21 +27,46 @@ const (
 	MAXDATALEN = 75744000
 	MAXCONCURRENTSESSIONS = 16
 	TIMEOUTSECS = 30
+	EXTHEADER_FLAG = 0x80000000 // set in the length of the filepath when the extended header is sent
+	EXTHEADERLEN = 32 // the length of the metadata in the extended header (file_metadata_t in exthdr.h)
 )
 
 func roundUp4(x uint32) uint32 {
 	return (x + 3) & 0xFFFFFFFC
 }
 
+/* The metadata sent in the extended header, describing the records in a file. */
+type FileMetadata struct {
+	FirstTime time.Time `json:"first_time" bson:"first_time"`
+	LastTime time.Time `json:"last_time" bson:"last_time"`
+	NumRecords uint32 `json:"num_records" bson:"num_records"`
+	LockChanges uint32 `json:"lock_changes" bson:"lock_changes"`
+	NofixRecords uint32 `json:"nofix_records" bson:"nofix_records"`
+	Discontinuities uint32 `json:"discontinuities" bson:"discontinuities"`
+}
+
+func parseMetadata(md []byte) *FileMetadata {
+	return &FileMetadata{
+		FirstTime: time.Unix(int64(binary.LittleEndian.Uint64(md[0:8])), 0).UTC(),
+		LastTime: time.Unix(int64(binary.LittleEndian.Uint64(md[8:16])), 0).UTC(),
+		NumRecords: binary.LittleEndian.Uint32(md[16:20]),
+		LockChanges: binary.LittleEndian.Uint32(md[20:24]),
+		NofixRecords: binary.LittleEndian.Uint32(md[24:28]),
+		Discontinuities: binary.LittleEndian.Uint32(md[28:32]),
+	}
+}
+
 type MessageDoc struct {
 	Filepath string `json:"name" bson:"name"`
 	Data bson.Binary `json:"data" bson:"data"`
 	Published bool `json:"published" bson:"published"`
 	TimeReceived time.Time `json:"time_received" bson:"time_received"`
 	SerialNumber string `json:"time_received" bson:"serial_number"`
+	Metadata *FileMetadata `json:"metadata,omitempty" bson:"metadata,omitempty"`
 }
 
-func processMessage(sendid []byte, sernum string, filepath string, data []byte) []byte {
+/* METADATA is nil unless the file was sent with the extended header. */
+func processMessage(sendid []byte, sernum string, filepath string, data []byte, metadata *FileMetadata) []byte {
 	var dberr error
 
 	var msgdoc *MessageDoc = &MessageDoc{
@@ -53,10 +78,16 @@ func processMessage(sendid []byte, sernum string, filepath string, data []byte)
 		Published: false,
 		TimeReceived: time.Now().UTC(),
 		SerialNumber: sernum,
+		Metadata: metadata,
 	}
 
 	var docsel bson.M = bson.M{"serial_number": sernum}
 	var updatecmd bson.M = bson.M{"$set": bson.M{"time_received": msgdoc.TimeReceived}}
+	if metadata != nil && metadata.NumRecords != 0 && !metadata.FirstTime.After(metadata.LastTime) {
+		// Keep the range of record times received next to the latest time
+		updatecmd["$min"] = bson.M{"earliest_record_time": metadata.FirstTime}
+		updatecmd["$max"] = bson.M{"latest_record_time": metadata.LastTime}
+	}
 
 	var session *mgo.Session = <- send_semaphore
 	var upmu_database *mgo.Database = session.DB("upmu_database")
@@ -99,6 +130,9 @@ func handlePMUConn(conn *net.TCPConn) {
 	/* The id of a message is 4 bytes long. */
 	var sendid []byte
 
+	/* The length of the metadata in the extended header (0 if it is not sent). */
+	var lenmd uint32
+
 	/* The length of the filepath. */
 	var lenfp uint32
 	/* The length of the filepath, including the padding added so it ends on a word boundary. */
@@ -120,6 +154,11 @@ func handlePMUConn(conn *net.TCPConn) {
 	var infobuffer [16]byte
 	var ibindex uint32
 
+	/* MDBUFFER stores the metadata in the extended header received so far. */
+	var mdbuffer [EXTHEADERLEN]byte
+	var mdindex uint32
+	var metadata *FileMetadata
+
 	/* FPBUFFER stores the filepath data received so far. */
 	var fpbuffer []byte = make([]byte, MAXFILEPATHLEN, MAXFILEPATHLEN)
 	var fpindex uint32
@@ -149,6 +188,8 @@ func handlePMUConn(conn *net.TCPConn) {
 	// Infinite loop to keep reading messages until connection is closed
 	for {
 		ibindex = 0
+		mdindex = 0
+		metadata = nil
 		fpindex = 0
 		snindex = 0
 		dtindex = 0
@@ -168,6 +209,11 @@ func handlePMUConn(conn *net.TCPConn) {
 				if ibindex == 16 {
 					sendid = infobuffer[:4]
 					lenfp = binary.LittleEndian.Uint32(infobuffer[4:8])
+					lenmd = 0
+					if lenfp & EXTHEADER_FLAG != 0 {
+						lenfp &^= EXTHEADER_FLAG
+						lenmd = EXTHEADERLEN
+					}
 					lensn = binary.LittleEndian.Uint32(infobuffer[8:12])
 					lendt = binary.LittleEndian.Uint32(infobuffer[12:16])
 					lenpfp = roundUp4(lenfp)
@@ -191,7 +237,18 @@ func handlePMUConn(conn *net.TCPConn) {
 					}
 				}
 			}
-			if bpos < n && totrecv < 16 + lenpfp {
+			if bpos < n && totrecv < 16 + lenmd {
+				for mdindex < lenmd && bpos < n {
+					mdbuffer[mdindex] = buf[bpos]
+					mdindex++
+					bpos++
+					totrecv++
+				}
+				if mdindex == lenmd {
+					metadata = parseMetadata(mdbuffer[:])
+				}
+			}
+			if bpos < n && totrecv < 16 + lenmd + lenpfp {
 				for fpindex < lenpfp && bpos < n {
 					fpbuffer[fpindex] = buf[bpos]
 					fpindex++
@@ -202,7 +259,7 @@ func handlePMUConn(conn *net.TCPConn) {
 					filepath = string(fpbuffer[:lenfp])
 				}
 			}
-			if bpos < n && totrecv < 16 + lenpfp + lenpsn {
+			if bpos < n && totrecv < 16 + lenmd + lenpfp + lenpsn {
 				for snindex < lenpsn && bpos < n {
 					snbuffer[snindex] = buf[bpos]
 					snindex++
@@ -218,7 +275,7 @@ func handlePMUConn(conn *net.TCPConn) {
 					sernum = newsernum
 				}
 			}
-			if bpos < n && totrecv < 16 + lenpfp + lenpsn + lendt {
+			if bpos < n && totrecv < 16 + lenmd + lenpfp + lenpsn + lendt {
 				for dtindex < lendt && bpos < n {
 					dtbuffer[dtindex] = buf[bpos]
 					dtindex++
@@ -236,7 +293,7 @@ func handlePMUConn(conn *net.TCPConn) {
 					}
 					recvdfull = true
 					fmt.Printf("Received %s: serial number is %s (%s), length is %v\n", filepath, sernum, alias, lendt)
-					resp = processMessage(sendid, sernum, filepath, dtbuffer[:lendt])
+					resp = processMessage(sendid, sernum, filepath, dtbuffer[:lendt], metadata)
 					_, erw = conn.Write(resp)
 					if erw != nil {
 						fmt.Printf("Connection lost: %v (write failed: %v)\n", conn.RemoteAddr().String(), erw);
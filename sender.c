@@ -25,8 +25,21 @@
 #define NUMFAILURES 360 // the number of failed connection attempts that will be tolerated before the program exits
 #define MAXDEPTH 4 // the root directory is at depth 0
 #define CHUNK_SIZE 31560 // the size of the portions into which each file is broken up
+#define RECORDSIZE 6312 // the size of one record in a .dat file (CHUNK_SIZE is five of them)
+#define MAXCHUNKRECORDS 64 // the maximum number of records in a portion of a file when using adaptive transport
+#define MINSNDBUF 16384 // the minimum socket send buffer size when using adaptive transport
+#define MAXSNDBUF 4194304 // the maximum socket send buffer size when using adaptive transport
+#define RATESAMPLES 4 // the number of files acknowledged on a connection before its send buffer size is chosen (adaptive only)
+#define ADAPTIVE_ENV "SENDER_ADAPTIVE" // environment variable that enables adaptive transport when set to 1
+#define EXTHEADER_ENV "SENDER_EXTHEADER" // environment variable that enables the extended header when set to 1
+#define TIMESOFFSET 4 // the offset of times[6] (year, month, day, hour, minute, second) within a record
+#define LOCKSTATEOFFSET 28 // the offset of lockstate[120] within a record
+#define LOCKSTATELEN 120 // the number of lockstate samples in a record
+#define HASFIXOFFSET 6308 // the offset of hasFix (a float) within a record
 #define LASTFILEWAIT 240 // the number of seconds to wait before sending the last file when processing existing files
 #define SOCKETTIMEOUT 600 // the number of seconds to wait for a send or receive operation on a socket before timing out
+#define TRACE_RING_SIZE 4096 // the number of spans kept in memory when tracing is enabled
+#define TRACE_ENV "SENDER_TRACE" // environment variable naming the file trace spans are dumped to (tracing is disabled if unset)
 
 
 #include <errno.h>
@@ -34,6 +47,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
 #include <dirent.h>
 #include <libgen.h>
 #include <unistd.h>
@@ -43,6 +58,14 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "exthdr.h"
+
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT 25 // missing from older headers; kernels before 3.12 reject it
+#endif
 
 /* When my comments refer to the "root directory", they mean the directory the program is watching */
 
@@ -86,6 +109,69 @@ uint32_t sendid = 1;
 // the timeout for the socket
 struct timeval socket_timeout;
 
+// 1 if the socket buffer and chunk size are adapted to the measured link, 0 otherwise
+int adaptive = 0;
+
+// the size of the portions into which each file is broken up (always CHUNK_SIZE unless adaptive)
+uint32_t chunk_size = CHUNK_SIZE;
+
+// the socket send buffer size to request (0 to leave the kernel default) and the
+// smoothed delivery rate in bytes per second it was derived from
+int sndbuf_size = 0;
+uint64_t delivery_rate = 0;
+
+// Setting SO_SNDBUF turns off the kernel's send buffer autotuning for the socket,
+// and the kernel caps it at net.core.wmem_max (read into wmem_max, 0 if unknown,
+// and lowered if the kernel is found to clamp a request). Each connection starts
+// out autotuned and is only given a size once rate_samples (the number of files
+// acknowledged on it) reaches RATESAMPLES. sndbuf_pinned is 1 if SO_SNDBUF was set
+// on the current connection, and sndbuf_before is the autotuned value on the
+// current connection before it was set.
+int rate_samples = 0;
+int sndbuf_pinned = 0;
+int sndbuf_before = 0;
+int wmem_max = 0;
+
+// 1 if files are sent with the extended header, 0 otherwise
+int exthdr = 0;
+
+// the phases of handling a file that are recorded as trace spans
+enum trace_phase
+{
+    TRACE_DETECT,
+    TRACE_QUEUE,
+    TRACE_LASTFILEWAIT,
+    TRACE_READ,
+    TRACE_SEND,
+    TRACE_ACK,
+    TRACE_UNLINK,
+    TRACE_SLEEP,
+    TRACE_RECONNECT,
+    TRACE_NUMPHASES
+};
+
+const char* trace_phase_names[TRACE_NUMPHASES] = { "detect", "queue", "lastfilewait", "read", "send", "ack", "unlink", "sleep", "reconnect" };
+
+typedef struct
+{
+    uint64_t start; // microseconds since an arbitrary point (CLOCK_MONOTONIC)
+    uint32_t dur; // microseconds from the start of the span to its end
+    uint32_t busy; // microseconds actually spent in the phase (less than dur if it was interleaved with another phase)
+    uint32_t sendid;
+    uint32_t phase;
+    char name[FILENAMELEN];
+} trace_span_t;
+
+// the ring of recorded spans (NULL if tracing is disabled) and the number of spans ever recorded
+trace_span_t* trace_ring = NULL;
+uint32_t trace_count = 0;
+
+// the file that trace spans are dumped to
+const char* trace_path = NULL;
+
+// set by SIGUSR1 to request that the trace spans be dumped
+volatile sig_atomic_t trace_dump_requested = 0;
+
 /* Deletes a directory if possible, printing messages as necessary. */
 void remove_dir(const char* dirpath)
 {
@@ -109,6 +195,141 @@ uint32_t roundUp4(uint32_t input)
     return (input + 3) & 0xFFFFFFFCu;
 }
 
+/* Returns the current time in microseconds since an arbitrary point. */
+uint64_t monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Returns the current time in microseconds for use in trace spans, or 0 if
+ * tracing is disabled (so that tracing costs nothing more than a branch when
+ * it is turned off).
+ */
+uint64_t trace_now()
+{
+    if (trace_ring == NULL)
+    {
+        return 0;
+    }
+    return monotonic_us();
+}
+
+/* Records a span of phase PHASE for the file at FILEPATH that started at START
+ * and ended at END, of which BUSY microseconds were actually spent in the phase
+ * (pass 0 if the whole span was). The oldest span is overwritten if the ring is full.
+ */
+void trace_span(uint32_t phase, const char* filepath, uint64_t start, uint64_t end, uint64_t busy)
+{
+    if (trace_ring == NULL)
+    {
+        return;
+    }
+    trace_span_t* span = &trace_ring[trace_count++ % TRACE_RING_SIZE];
+    const char* name = strrchr(filepath, '/');
+    name = (name == NULL) ? filepath : name + 1;
+    span->start = start;
+    span->dur = (uint32_t) (end - start);
+    span->busy = (uint32_t) (busy == 0 ? end - start : busy);
+    span->sendid = sendid;
+    span->phase = phase;
+    strncpy(span->name, name, FILENAMELEN - 1);
+    span->name[FILENAMELEN - 1] = '\0';
+}
+
+/* Writes the spans in the ring to trace_path in the Chrome trace event format
+ * (which Perfetto and chrome://tracing can open), with one track per phase.
+ * The file is written under a temporary name and renamed so that a reader
+ * never sees a partial dump.
+ */
+void trace_dump()
+{
+    trace_dump_requested = 0;
+    if (trace_ring == NULL)
+    {
+        return;
+    }
+    char tmppath[strlen(trace_path) + 5];
+    strcpy(tmppath, trace_path);
+    strcat(tmppath, ".tmp");
+    FILE* output = fopen(tmppath, "w");
+    if (output == NULL)
+    {
+        printf("Could not open %s to dump trace spans\n", tmppath);
+        return;
+    }
+    fprintf(output, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(output, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"sender %s\"}}", serialNum);
+    uint32_t i;
+    for (i = 0; i < TRACE_NUMPHASES; i++)
+    {
+        fprintf(output, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", i, trace_phase_names[i]);
+    }
+    uint32_t first = (trace_count > TRACE_RING_SIZE) ? trace_count - TRACE_RING_SIZE : 0;
+    for (i = first; i != trace_count; i++)
+    {
+        trace_span_t* span = &trace_ring[i % TRACE_RING_SIZE];
+        char* c;
+        fprintf(output, ",\n{\"name\":\"");
+        for (c = span->name; *c != '\0'; c++)
+        {
+            if (*c == '"' || *c == '\\')
+            {
+                fputc('\\', output);
+            }
+            fputc((*c < 0x20) ? '?' : *c, output);
+        }
+        fprintf(output, "\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%llu,\"dur\":%u,\"args\":{\"sendid\":%u,\"busy_us\":%u}}",
+                trace_phase_names[span->phase], span->phase, (unsigned long long) span->start, span->dur, span->sendid, span->busy);
+    }
+    fprintf(output, "\n]}\n");
+    if (fclose(output) != 0 || rename(tmppath, trace_path) != 0)
+    {
+        printf("Could not write trace spans to %s\n", trace_path);
+        return;
+    }
+    printf("Dumped %u trace spans to %s\n", trace_count - first, trace_path);
+}
+
+/* Returns the trace time at which the file at FILEPATH was last written (its
+ * modification time, moved from the realtime clock onto the clock used for
+ * trace spans), or the current trace time if that cannot be determined. This
+ * is when the file became ready to send, however long it then waited.
+ */
+uint64_t trace_file_time(const char* filepath)
+{
+    struct stat fileStats;
+    struct timespec realnow;
+    uint64_t tnow = trace_now();
+    if (tnow == 0 || stat(filepath, &fileStats) != 0 || clock_gettime(CLOCK_REALTIME, &realnow) != 0)
+    {
+        return tnow;
+    }
+    uint64_t age = (realnow.tv_sec > fileStats.st_mtime) ? ((uint64_t) (realnow.tv_sec - fileStats.st_mtime)) * 1000000 : 0;
+    return (age < tnow) ? tnow - age : tnow;
+}
+
+void trace_dump_handler(int sig)
+{
+    trace_dump_requested = 1;
+}
+
+/* Sleeps for SECONDS seconds, even if a signal arrives in the meantime. If the
+ * signal was a request to dump trace spans, they are dumped right away rather
+ * than after the sleep.
+ */
+void sleep_fully(unsigned int seconds)
+{
+    while ((seconds = sleep(seconds)) > 0)
+    {
+        if (trace_dump_requested)
+        {
+            trace_dump();
+        }
+    }
+}
+
 /* Close the socket connection. */
 void close_connection(int socket_descriptor)
 {
@@ -124,10 +345,254 @@ void safe_exit(int arg)
     {
         close_connection(socket_des);
     }
+    trace_dump();
     fflush(stdout);
     exit(arg);
 }
 
+/* Applies the socket buffer size and unsent data threshold chosen by
+ * adapt_transport() to SOCKET_DESCRIPTOR. Does nothing unless adaptive
+ * transport is enabled.
+ */
+void apply_transport(int socket_descriptor)
+{
+    if (!adaptive)
+    {
+        return;
+    }
+    if (sndbuf_size != 0)
+    {
+        if (setsockopt(socket_descriptor, SOL_SOCKET, SO_SNDBUF, &sndbuf_size, sizeof(sndbuf_size)) != 0)
+        {
+            perror("could not set socket send buffer size");
+        }
+        else
+        {
+            sndbuf_pinned = 1;
+        }
+    }
+    // Keep no more than one chunk queued in the kernel beyond what is in flight
+    int lowat = chunk_size;
+    if (setsockopt(socket_descriptor, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) != 0)
+    {
+        perror("could not set unsent data threshold");
+    }
+}
+
+/* Returns net.core.wmem_max, the largest send buffer size that SO_SNDBUF can
+ * request, or 0 if it cannot be read.
+ */
+int read_wmem_max()
+{
+    int value = 0;
+    FILE* input = fopen("/proc/sys/net/core/wmem_max", "r");
+    if (input == NULL)
+    {
+        return 0;
+    }
+    if (fscanf(input, "%d", &value) != 1)
+    {
+        value = 0;
+    }
+    fclose(input);
+    return value;
+}
+
+/* Measures the connection on SOCKET_DESCRIPTOR after a file has been sent and
+ * acknowledged, and sizes the socket send buffer and write chunk to the
+ * bandwidth-delay product. LENGTH is the number of bytes sent, WRITETIME the
+ * number of microseconds spent writing them, and ACKWAIT the number of
+ * microseconds between the last write and the confirmation of receipt.
+ */
+void adapt_transport(int socket_descriptor, uint32_t length, uint64_t writetime, uint64_t ackwait)
+{
+    struct tcp_info info;
+    socklen_t infolen = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(socket_descriptor, IPPROTO_TCP, TCP_INFO, &info, &infolen) != 0)
+    {
+        perror("could not get TCP info");
+    }
+    // Prefer the kernel's smoothed RTT; the confirmation also includes the server's processing time
+    uint64_t rtt = (info.tcpi_rtt != 0) ? info.tcpi_rtt : ackwait;
+    if (rtt == 0)
+    {
+        rtt = 1;
+    }
+    // Once the last write returns, at most about one RTT of data is left to deliver
+    uint64_t rate = ((uint64_t) length) * 1000000 / (writetime + rtt);
+    delivery_rate = (delivery_rate == 0) ? rate : (3 * delivery_rate + rate) / 4;
+    uint64_t bdp = delivery_rate * rtt / 1000000;
+
+    uint64_t chunk = (bdp / RECORDSIZE) * RECORDSIZE;
+    chunk = (chunk < RECORDSIZE) ? RECORDSIZE : ((chunk > MAXCHUNKRECORDS * RECORDSIZE) ? MAXCHUNKRECORDS * RECORDSIZE : chunk);
+    chunk_size = (uint32_t) chunk;
+
+    // Twice the BDP, so that a buffer that is limiting the rate can still grow
+    uint64_t target = 2 * bdp;
+    target = (target < MINSNDBUF) ? MINSNDBUF : ((target > MAXSNDBUF) ? MAXSNDBUF : target);
+    int actual = 0;
+    socklen_t actuallen = sizeof(actual);
+    const char* sndbuf_reason;
+    rate_samples++;
+    if (!sndbuf_pinned)
+    {
+        // The kernel reports (and autotunes) twice the size that SO_SNDBUF requests
+        getsockopt(socket_descriptor, SOL_SOCKET, SO_SNDBUF, &sndbuf_before, &actuallen);
+    }
+    // Compared against the target every time; once set, a socket stays out of
+    // autotuning, so a choice to leave it applies from the next connection
+    sndbuf_size = 0;
+    if (rate_samples < RATESAMPLES)
+    {
+        sndbuf_reason = "delivery rate not yet measured on this connection";
+    }
+    else if (wmem_max != 0 && target > (uint64_t) wmem_max)
+    {
+        sndbuf_reason = "size needed is above net.core.wmem_max";
+    }
+    else if (2 * target < (uint64_t) sndbuf_before)
+    {
+        sndbuf_reason = "autotuning gives a larger buffer";
+    }
+    else
+    {
+        sndbuf_size = (int) target;
+        sndbuf_reason = "set to twice the BDP";
+    }
+    apply_transport(socket_descriptor);
+
+    actuallen = sizeof(actual);
+    getsockopt(socket_descriptor, SOL_SOCKET, SO_SNDBUF, &actual, &actuallen);
+    if (sndbuf_size != 0 && (uint64_t) actual < 2 * target)
+    {
+        // The limit is lower than wmem_max said (or it could not be read)
+        wmem_max = actual / 2;
+        sndbuf_reason = "clamped by the kernel";
+    }
+    printf("Transport: rtt %u us (var %u us), ack wait %llu us, cwnd %u, delivery rate %llu B/s, BDP %llu B; SO_SNDBUF requested %d (%s%s), kernel %d; chunk %u B\n",
+           info.tcpi_rtt, info.tcpi_rttvar, (unsigned long long) ackwait, info.tcpi_snd_cwnd, (unsigned long long) delivery_rate,
+           (unsigned long long) bdp, sndbuf_size, sndbuf_reason, (sndbuf_size == 0 && sndbuf_pinned) ? ", still set on this connection" : "",
+           actual, chunk_size);
+}
+
+/* Used to compare two record times so they can be sorted. */
+int time_comparator(const void* t1, const void* t2)
+{
+    int64_t a = *((const int64_t*) t1);
+    int64_t b = *((const int64_t*) t2);
+    return (a > b) - (a < b);
+}
+
+/* Converts the times[6] of a record (year, month, day, hour, minute, second) into
+ * seconds since the epoch, stored in RESULT. Returns 0 on success and 1 if the
+ * time is not a valid one from 1970 onwards.
+ */
+int record_time(const int32_t* times, int64_t* result)
+{
+    struct tm recordtime;
+    if (times[0] < 1970 || times[0] > 9999 || times[1] < 1 || times[1] > 12 || times[2] < 1 || times[2] > 31
+        || times[3] < 0 || times[3] > 23 || times[4] < 0 || times[4] > 59 || times[5] < 0 || times[5] > 59)
+    {
+        return 1;
+    }
+    memset(&recordtime, 0, sizeof(recordtime));
+    recordtime.tm_year = times[0] - 1900;
+    recordtime.tm_mon = times[1] - 1;
+    recordtime.tm_mday = times[2];
+    recordtime.tm_hour = times[3];
+    recordtime.tm_min = times[4];
+    recordtime.tm_sec = times[5];
+    time_t converted = timegm(&recordtime);
+    // timegm() moves days past the end of the month into the next one
+    if (converted == (time_t) -1 || recordtime.tm_mday != times[2] || recordtime.tm_mon != times[1] - 1)
+    {
+        return 1;
+    }
+    *result = (int64_t) converted;
+    return 0;
+}
+
+/* Reads every complete record in INPUT (the file at FILEPATH, which is LENGTH
+ * bytes long) and fills in METADATA with the time range the file covers and the
+ * anomalies in it. Only the timestamps, lockstate and hasFix of each record are
+ * examined. The records are not necessarily in time order, so the range is from
+ * the earliest to the latest, and gaps are counted after sorting the times.
+ * Records whose times are invalid are left out entirely (so the file is reported
+ * as partial) and counted in a warning.
+ * Returns 0 on success and 1 if the file could not be read.
+ */
+int scan_records(FILE* input, const char* filepath, uint32_t length, file_metadata_t* metadata)
+{
+    uint8_t record[RECORDSIZE] __attribute__((aligned(4)));
+    int32_t* times = (int32_t*) (record + TIMESOFFSET);
+    int32_t* lockstate = (int32_t*) (record + LOCKSTATEOFFSET);
+    float hasFix;
+    int32_t prevlock = 0;
+    uint32_t numrecords = length / RECORDSIZE;
+    uint32_t i, j;
+
+    memset(metadata, 0, sizeof(file_metadata_t));
+    int64_t* t = malloc((numrecords + 1) * sizeof(int64_t));
+    if (t == NULL)
+    {
+        printf("Could not allocate memory to store record times.\n");
+        safe_exit(1);
+    }
+    rewind(input);
+    for (i = 0; i < numrecords; i++)
+    {
+        if (fread(record, 1, RECORDSIZE, input) != RECORDSIZE)
+        {
+            free(t);
+            return 1;
+        }
+        if (record_time(times, &t[metadata->num_records]) != 0)
+        {
+            continue;
+        }
+        metadata->num_records++;
+        if (metadata->num_records == 1)
+        {
+            prevlock = lockstate[0];
+        }
+        for (j = 0; j < LOCKSTATELEN; j++)
+        {
+            if (lockstate[j] != prevlock)
+            {
+                metadata->lock_changes++;
+                break;
+            }
+        }
+        prevlock = lockstate[LOCKSTATELEN - 1];
+        memcpy(&hasFix, record + HASFIXOFFSET, sizeof(hasFix));
+        if (hasFix == 0.0f)
+        {
+            metadata->nofix_records++;
+        }
+    }
+    if (metadata->num_records < numrecords)
+    {
+        printf("WARNING: %u of the %u records in %s have invalid times and are left out of the extended header\n",
+               numrecords - metadata->num_records, numrecords, filepath);
+    }
+    if (metadata->num_records > 0)
+    {
+        qsort(t, metadata->num_records, sizeof(int64_t), time_comparator);
+        metadata->first_time = t[0];
+        metadata->last_time = t[metadata->num_records - 1];
+        for (i = 1; i < metadata->num_records; i++)
+        {
+            if (t[i] > t[i - 1] + 1)
+            {
+                metadata->discontinuities++;
+            }
+        }
+    }
+    free(t);
+    return 0;
+}
+
 /* Attempts to connect to the server_addr and returns the socket descriptor
  * if successful. If not successful, return -1.
  */
@@ -154,6 +619,11 @@ int make_socket()
         close(socket_descriptor);
         return -1;
     }
+    // Each connection starts out autotuned until its delivery rate has been measured
+    sndbuf_pinned = 0;
+    sndbuf_size = 0;
+    rate_samples = 0;
+    apply_transport(socket_descriptor);
     printf("Successfully connected\n");
     return socket_descriptor;
 }
@@ -163,6 +633,9 @@ int make_socket()
  * The total data sent is: 1. an id number, 2. the length of the filepath, 3.
  * the filepath, 4. the length of the contents of the file, and 5. the contents
  * of the file.
+ * If the extended header is enabled, EXTHEADER_FLAG is set in the length of the
+ * filepath and a file_metadata_t describing the records in the file is sent
+ * right after the lengths.
  * The filepath sent includes the filename itself, and contains the parent directory
  * if INROOTDIR is 1.
  * Returns 0 if the transmission was successful or if the file did not have to be sent.
@@ -195,29 +668,66 @@ int send_file(int socket_descriptor, const char* filepath)
     fseek(input, 0, SEEK_END);
     uint32_t length = ftell(input);
     
+    // The extended header has to be sent before the data, so the records are
+    // scanned first (this reads the file into the page cache for the send below)
+    file_metadata_t metadata;
+    uint32_t infolen = 16;
+    if (exthdr)
+    {
+        uint64_t tscan = trace_now();
+        if (scan_records(input, filepath, length, &metadata) != 0)
+        {
+            printf("Error: could not scan records in file %s\n", filepath);
+            fclose(input);
+            return 1;
+        }
+        trace_span(TRACE_READ, filepath, tscan, trace_now(), 0);
+        infolen += EXTHEADERLEN;
+    }
+
     // Store file number (sendid), length of serial number, length of filename, length of data, and filename in data array
     // The null terminator may be overwritten; the length of the filename does not
     // include the null terminator.
     // Space is added to the end of filename so it is word-aligned.
     uint32_t size_word = roundUp4(size); // size with extra bytes so it's word-aligned
-    uint8_t data[16 + size_word + size_serial_word] __attribute__((aligned(4)));
-    memset(data, 0, 16 + size_word + size_serial_word);
+    uint8_t data[infolen + size_word + size_serial_word] __attribute__((aligned(4)));
+    memset(data, 0, infolen + size_word + size_serial_word);
     *((uint32_t*) data) = sendid;
-    *((uint32_t*) (data + 4)) = size;
+    *((uint32_t*) (data + 4)) = exthdr ? (size | EXTHEADER_FLAG) : size;
     *((uint32_t*) (data + 8)) = size_serial;
     *((uint32_t*) (data + 12)) = length;
-    strcpy((char*) (data + 16), filepath);
-    strcpy((char*) (data + 16 + size_word), serialNum);
+    if (exthdr)
+    {
+        memcpy(data + 16, &metadata, EXTHEADERLEN);
+    }
+    strcpy((char*) (data + infolen), filepath);
+    strcpy((char*) (data + infolen + size_word), serialNum);
     rewind(input);
     
+    // Time spent reading the file and writing to the socket, for tracing
+    uint64_t tstart = trace_now();
+    uint64_t tread = 0, twrite = 0, treadstart = 0, twritestart = tstart, tnow;
+
+    // Time spent transferring the file, for adaptive transport
+    uint64_t xferstart = adaptive ? monotonic_us() : 0;
+    uint64_t xferend = 0;
+
     // Send info
-    int32_t dataleft = 16 + size_word + size_serial_word;
+    int32_t dataleft = infolen + size_word + size_serial_word;
     int32_t datawritten;
     uint8_t* dest = data;
     while (dataleft > 0)
     {
         errno = 0;
         datawritten = write(socket_descriptor, dest, dataleft);
+        if (datawritten < 0 && errno == EINTR)
+        {
+            if (trace_dump_requested)
+            {
+                trace_dump();
+            }
+            continue; // interrupted by SIGUSR1 before anything was written
+        }
         if (datawritten < 0 || errno != 0)
         {
             printf("Could not send file %s\n", filepath);
@@ -228,20 +738,26 @@ int send_file(int socket_descriptor, const char* filepath)
         dest += datawritten;
     }
     // Send data
-    uint8_t* tosend = malloc(CHUNK_SIZE);
+    uint32_t chunk = chunk_size;
+    uint8_t* tosend = malloc(chunk);
     if (tosend == NULL) {
         printf("Could not allocate memory to store part of data file; try reducing CHUNK_SIZE.");
         safe_exit(1);
     }
     uint32_t totalread = 0;
     int32_t dataread;
+    tnow = trace_now();
+    twrite += tnow - twritestart;
     while (totalread != length)
     {
-        dataread = fread(tosend, 1, CHUNK_SIZE, input);
+        treadstart = (treadstart == 0) ? tnow : treadstart;
+        dataread = fread(tosend, 1, chunk, input);
+        twritestart = trace_now();
+        tread += twritestart - tnow;
         totalread += dataread;
         dataleft = dataread;
         dest = tosend;
-        if (dataread != CHUNK_SIZE && totalread != length)
+        if (dataread != (int32_t) chunk && totalread != length)
         {
             printf("Error: could not finish reading file %s (read %d out of %d bytes)\n", filepath, totalread, length);
             free(tosend);
@@ -252,6 +768,14 @@ int send_file(int socket_descriptor, const char* filepath)
         {
             errno = 0;
             datawritten = write(socket_descriptor, dest, dataleft);
+            if (datawritten < 0 && errno == EINTR)
+            {
+                if (trace_dump_requested)
+                {
+                    trace_dump();
+                }
+                continue; // interrupted by SIGUSR1 before anything was written
+            }
             if (datawritten < 0 || errno != 0)
             {
                 printf("Could not send file %s\n", filepath);
@@ -262,9 +786,18 @@ int send_file(int socket_descriptor, const char* filepath)
             dataleft -= datawritten;
             dest += datawritten;
         }
+        tnow = trace_now();
+        twrite += tnow - twritestart;
     }
     free(tosend);
     fclose(input);
+    xferend = adaptive ? monotonic_us() : 0;
+    tnow = trace_now();
+    if (treadstart != 0)
+    {
+        trace_span(TRACE_READ, filepath, treadstart, tnow, tread);
+    }
+    trace_span(TRACE_SEND, filepath, tstart, tnow, twrite);
     uint32_t response;
     
     // Get confirmation of receipt    
@@ -273,6 +806,14 @@ int send_file(int socket_descriptor, const char* filepath)
     {
         errno = 0;
         dataread = read(socket_descriptor, ((uint8_t*) &response) + 4 - dataleft, 4);
+        if (dataread < 0 && errno == EINTR)
+        {
+            if (trace_dump_requested)
+            {
+                trace_dump();
+            }
+            continue; // interrupted by SIGUSR1 before anything was read
+        }
         if (dataread < 0 || errno != 0)
         {
             printf("Could not receive confirmation of receipt of %s\n", filepath);
@@ -285,24 +826,34 @@ int send_file(int socket_descriptor, const char* filepath)
         }
         dataleft -= dataread;
     }
+    trace_span(TRACE_ACK, filepath, tnow, trace_now(), 0);
     
-    if (response != sendid++)
+    if (response != sendid)
     {
         printf("Received improper confirmation of receipt of %s (will not be deleted)\n", filepath);
     }
     else
     {
+        if (adaptive)
+        {
+            adapt_transport(socket_descriptor, infolen + size_word + size_serial_word + length, xferend - xferstart, monotonic_us() - xferend);
+        }
+
         // Delete the file
+        tnow = trace_now();
         if (unlink(filepath) != 0)
         {
             printf("File %s was successfully sent and confirmation was received, but could not be deleted\n", filepath);
         }
+        trace_span(TRACE_UNLINK, filepath, tnow, trace_now(), 0);
     }
-    if (sendid == 0xFFFFFFFFu)
+    tnow = trace_now();
+    sleep_fully(1); // So that we don't use too much CPU time
+    trace_span(TRACE_SLEEP, filepath, tnow, trace_now(), 0);
+    if (++sendid == 0xFFFFFFFFu)
     {
         sendid = 1;
     }
-    sleep(1); // So that we don't use too much CPU time
     return 0;
 }
 
@@ -310,14 +861,22 @@ int send_file(int socket_descriptor, const char* filepath)
  * of the value itself, and that it will repeatedly try to send the file (waiting
  * TIMEDELAY seconds between attempts) if the file could be read but could not be sent
  * over TCP. It returns the value of the successful attempt (so it will never return -1,
- * just 0 or 1).
+ * just 0 or 1). DETECTED is the trace time at which the file was ready to send, and
+ * is used to record how long the file was queued before the first attempt (pass 0
+ * if the caller has already recorded that).
  */
-int send_until_success(int* socket_descriptor, const char* filepath)
+int send_until_success(int* socket_descriptor, const char* filepath, uint64_t detected)
 {
     int result;
     int numreconnects = -1;
+    uint64_t tnow = trace_now();
+    if (detected != 0)
+    {
+        trace_span(TRACE_QUEUE, filepath, detected, tnow, 0);
+    }
     while ((result = send_file(*socket_descriptor, filepath)) == -1)
     {
+        tnow = trace_now();
         if (++numreconnects >= NUMFAILURES) {
             printf("Connection lost; failed to reconnect %d times. Exiting program.\n", numreconnects);
             safe_exit(1);
@@ -327,11 +886,16 @@ int send_until_success(int* socket_descriptor, const char* filepath)
             close_connection(*socket_descriptor);
             connected = 0;
         }
-        sleep(TIMEDELAY);
+        sleep_fully(TIMEDELAY);
         printf("Connection appears to be lost\n");
         *socket_descriptor = make_socket();
+        trace_span(TRACE_RECONNECT, filepath, tnow, trace_now(), 0);
     }
     connected = 1;
+    if (trace_dump_requested)
+    {
+        trace_dump();
+    }
     return result;
 }
 
@@ -447,6 +1011,7 @@ int processdir(const char* dirpath, int* socket_descriptor, int inotify_fd, int
     qsort(filearr, numfiles, FILENAMELEN, file_entry_comparator);
     qsort(subdirarr, numsubdirs, FILENAMELEN, file_entry_comparator);
     
+    uint64_t tnow, detected;
     for (fileIndex = 0; fileIndex < numfiles; fileIndex++)
     {
         strcpy(fullpath, dirpath);
@@ -454,9 +1019,25 @@ int processdir(const char* dirpath, int* socket_descriptor, int inotify_fd, int
         if (addwatchtosubs && (fileIndex == numfiles - 1))
         {
             printf("Waiting %d seconds for last file...\n", LASTFILEWAIT);
-            sleep(LASTFILEWAIT);
+            tnow = trace_now();
+            sleep_fully(LASTFILEWAIT);
+            trace_span(TRACE_LASTFILEWAIT, fullpath, tnow, trace_now(), 0);
+            // The last file may still have been being written when the wait started
+            detected = trace_file_time(fullpath);
+            trace_span(TRACE_DETECT, fullpath, detected, detected, 0);
+            if (detected < tnow)
+            {
+                // Queued until the wait started; the wait has its own span
+                trace_span(TRACE_QUEUE, fullpath, detected, tnow, 0);
+                detected = 0;
+            }
+        }
+        else
+        {
+            detected = trace_file_time(fullpath);
+            trace_span(TRACE_DETECT, fullpath, detected, detected, 0);
         }
-        send_until_success(socket_descriptor, fullpath);
+        send_until_success(socket_descriptor, fullpath, detected);
     }
     
     free(filearr);
@@ -546,6 +1127,43 @@ int main(int argc, char* argv[])
         exit(1);
     }
 
+    struct sigaction trace_action;
+    trace_action.sa_handler = trace_dump_handler;
+    trace_action.sa_flags = SA_RESTART;
+    sigemptyset(&trace_action.sa_mask);
+    if (-1 == sigaction(SIGUSR1, &trace_action, NULL))
+    {
+        printf("Could not set up signal to dump trace spans\n");
+        exit(1);
+    }
+
+    char* adaptive_env = getenv(ADAPTIVE_ENV);
+    if (adaptive_env != NULL && strcmp(adaptive_env, "1") == 0)
+    {
+        adaptive = 1;
+        wmem_max = read_wmem_max();
+        printf("Adaptive transport enabled\n");
+    }
+
+    char* exthdr_env = getenv(EXTHEADER_ENV);
+    if (exthdr_env != NULL && strcmp(exthdr_env, "1") == 0)
+    {
+        exthdr = 1;
+        printf("Extended header enabled\n");
+    }
+
+    trace_path = getenv(TRACE_ENV);
+    if (trace_path != NULL && trace_path[0] != '\0')
+    {
+        trace_ring = malloc(TRACE_RING_SIZE * sizeof(trace_span_t));
+        if (trace_ring == NULL)
+        {
+            printf("Could not allocate memory to store trace spans; try reducing TRACE_RING_SIZE.\n");
+            safe_exit(1);
+        }
+        printf("Tracing enabled: send SIGUSR1 to dump spans to %s\n", trace_path);
+    }
+
     struct sigaction socket_action;
     socket_action.sa_handler = SIG_IGN;
     socket_action.sa_flags = 0;
@@ -582,7 +1200,7 @@ int main(int argc, char* argv[])
             printf("Failed to connect %d times. Exiting program.\n", numreconnects);
             safe_exit(1);
         }
-        sleep(TIMEDELAY);
+        sleep_fully(TIMEDELAY);
         socket_des = make_socket();
     }
     connected = 1;
@@ -613,6 +1231,8 @@ int main(int argc, char* argv[])
 
     struct timeval timeout;
     int rlen;
+    int selecterr;
+    uint64_t tnow;
     
     char fullname[FULLPATHLEN];
 
@@ -626,9 +1246,14 @@ int main(int argc, char* argv[])
         timeout.tv_sec = 2; //Do a wavelet keepalive every 3 seconds
         timeout.tv_usec = 0;
         rlen = select(fd + 1, &set, NULL, NULL, &timeout);
-        if (rlen == 0)
+        selecterr = errno; // dumping trace spans may overwrite errno
+        if (trace_dump_requested)
+        {
+            trace_dump();
+        }
+        if (rlen == 0 || (rlen < 0 && selecterr == EINTR))
         {
-            // no activity
+            // no activity (or interrupted by a request to dump trace spans)
             continue;
         }
         rlen = read(fd, buffer, EVENT_BUF_LEN);
@@ -712,7 +1337,9 @@ int main(int argc, char* argv[])
                     {
                         strcpy(fullname, children[MAXDEPTH].path);
                         strcat(fullname, ev->name);
-                        result = send_until_success(&socket_des, fullname);
+                        tnow = trace_file_time(fullname);
+                        trace_span(TRACE_DETECT, fullname, tnow, tnow, 0);
+                        result = send_until_success(&socket_des, fullname, tnow);
                     }
                     else
                     {